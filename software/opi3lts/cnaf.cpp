@@ -10,6 +10,9 @@
 #include <alsa/asoundlib.h>
 #include <mutex>
 #include <math.h>
+#include <atomic>
+#include <climits>
+#include <cstdint>
 
 //HARDCODED FOR 8 CHANNELS: 4 FLOPPY DRIVES, TRANSFORMER, BUZZER, SMALL HDD, BIG HDD
 //PINOUT(GPIO HEADER FOR ORANGE PI 3 LTS):
@@ -56,11 +59,27 @@ struct channel_state {
     int curr_velocity;
     std::chrono::time_point<std::chrono::high_resolution_clock> last_time;
     std::chrono::high_resolution_clock::duration curr_period;
+    std::chrono::high_resolution_clock::duration target_period; //curr_period glides to this one
+    std::chrono::high_resolution_clock::duration glide_start_period;
+    std::chrono::time_point<std::chrono::high_resolution_clock> glide_start_time;
+    int seq_note; //note/velocity/remap state matching curr_period, owned by sequencer
+    int seq_velocity;
+    bool seq_remapped;
     bool remapped;
     bool enabled;
 };
 
+struct pending_note {
+    int32_t period; //high_resolution_clock ticks, NO_PERIOD when nothing is pending
+    int16_t note;
+    int8_t velocity;
+    bool remapped;
+};
+
 #define CH_NUM 8
+#define GLIDE_TIME_US 10000 //period interpolation time between pitch bend updates
+#define NO_BEND INT_MIN
+#define NO_PERIOD -1
 
 const channel_cfg channel_cfgs[CH_NUM] = {
     {160, 20.0, 525.0},
@@ -74,6 +93,12 @@ const channel_cfg channel_cfgs[CH_NUM] = {
 };
 
 channel_state channel_states[CH_NUM];
+//Latest pitch bend per channel, written by midi thread and consumed by sequencer once per tick
+std::atomic<int> pending_bends[CH_NUM];
+//Note on/off/reset for hardware channels. Sequencer is the only writer of curr_period,
+//before it starts channel_states are zero-initialized
+std::atomic<pending_note> pending_notes[CH_NUM];
+static_assert(std::atomic<pending_note>::is_always_lock_free);
 
 // trim from end (in place)
 static inline void rtrim(std::string &s) {
@@ -86,6 +111,19 @@ static inline double midiNoteToFrequency(float note) {
     return pow(2.0f, ((note-69)/12.0f))*440.0;
 }
 
+static inline std::chrono::high_resolution_clock::duration channel_period(int ch, long period_us, int velocity) {
+    switch(ch) {
+        case 0:
+            //Drive 0 requires double frequency
+            return std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/4));
+        case 6:
+        case 7:
+            return std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(velocity*550L));
+        default:
+            return std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/2));
+    }
+}
+
 void update_shiftreg() {
     chip1_state[0] = 0; //SHCP=0
     c1lines.set_values(chip1_state);
@@ -114,7 +152,8 @@ void reset_channels() {
     for(int i = 0; i<8; i++) {
         channel_states[i].curr_steps = 0;
         channel_states[i].last_time = std::chrono::high_resolution_clock::now();
-        channel_states[i].curr_period = (std::chrono::duration<long, std::micro> {0});
+        pending_bends[i] = NO_BEND;
+        pending_notes[i] = {0, 0, 0, false};
         channel_states[i].remapped = false;
         channel_states[i].enabled = false;
         channel_states[i].curr_playing_note = 0;
@@ -171,7 +210,8 @@ void reset_channel(int num) {
         channel_states[num].curr_steps = 0;
         channel_states[num].curr_phase = 0;
         channel_states[num].last_time = std::chrono::high_resolution_clock::now();
-        channel_states[num].curr_period = (std::chrono::duration<long, std::micro> {0});
+        pending_bends[num] = NO_BEND;
+        pending_notes[num] = {0, 0, 0, false};
         channel_states[num].remapped = false;
         channel_states[num].enabled = false;
         channel_states[num].curr_playing_note = 0;
@@ -201,7 +241,8 @@ void reset_channel(int num) {
         channel_states[num].curr_steps = 0;
         channel_states[num].curr_phase = 0;
         channel_states[num].last_time = std::chrono::high_resolution_clock::now();
-        channel_states[num].curr_period = (std::chrono::duration<long, std::micro> {0});
+        pending_bends[num] = NO_BEND;
+        pending_notes[num] = {0, 0, 0, false};
         channel_states[num].remapped = false;
         channel_states[num].enabled = false;
         channel_states[num].curr_playing_note = 0;
@@ -218,7 +259,8 @@ void reset_channel(int num) {
         channel_states[num].curr_steps = 0;
         channel_states[num].curr_phase = 0;
         channel_states[num].last_time = std::chrono::high_resolution_clock::now();
-        channel_states[num].curr_period = (std::chrono::duration<long, std::micro> {0});
+        pending_bends[num] = NO_BEND;
+        pending_notes[num] = {0, 0, 0, false};
         channel_states[num].remapped = false;
         channel_states[num].enabled = false;
         channel_states[num].curr_playing_note = 0;
@@ -232,6 +274,51 @@ void reset_channel(int num) {
     //hdds ignored
 }
 
+void update_bend(int ch) {
+    //Called on every sequencer pass, so slots are checked with plain loads before exchange
+    //Note on/off always wins over glide
+    if(pending_notes[ch].load(std::memory_order_relaxed).period != NO_PERIOD) {
+        pending_note pn = pending_notes[ch].exchange({NO_PERIOD, 0, 0, false});
+        channel_states[ch].curr_period = std::chrono::high_resolution_clock::duration(pn.period);
+        channel_states[ch].target_period = channel_states[ch].curr_period;
+        channel_states[ch].glide_start_period = channel_states[ch].curr_period;
+        channel_states[ch].glide_start_time = std::chrono::high_resolution_clock::now();
+        channel_states[ch].seq_note = pn.note;
+        channel_states[ch].seq_velocity = pn.velocity;
+        channel_states[ch].seq_remapped = pn.remapped;
+    }
+    //Only the latest bend since previous tick is applied, then period glides to it
+    int bend = NO_BEND;
+    if(pending_bends[ch].load(std::memory_order_relaxed) != NO_BEND) {
+        bend = pending_bends[ch].exchange(NO_BEND);
+    }
+    if(bend == NO_BEND && channel_states[ch].curr_period == channel_states[ch].target_period) {
+        return;
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> now = std::chrono::high_resolution_clock::now();
+    if(bend != NO_BEND && channel_states[ch].curr_period.count() != 0 && channel_states[ch].seq_note != 0 && !channel_states[ch].seq_remapped) {
+        float semitone_bend = bend/4096.0f;
+        double f = midiNoteToFrequency(channel_states[ch].seq_note+semitone_bend);
+        long period_us = (1000000L / f);
+        channel_states[ch].glide_start_period = channel_states[ch].curr_period;
+        channel_states[ch].glide_start_time = now;
+        channel_states[ch].target_period = channel_period(ch, period_us, channel_states[ch].seq_velocity);
+    }
+    if(channel_states[ch].curr_period.count() == 0 || channel_states[ch].target_period.count() == 0) {
+        //Channel stopped, nothing to glide
+        channel_states[ch].curr_period = std::chrono::high_resolution_clock::duration(0);
+        channel_states[ch].target_period = channel_states[ch].curr_period;
+        return;
+    }
+    std::chrono::high_resolution_clock::duration elapsed = now - channel_states[ch].glide_start_time;
+    std::chrono::high_resolution_clock::duration glide_time = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(GLIDE_TIME_US));
+    if(elapsed >= glide_time) {
+        channel_states[ch].curr_period = channel_states[ch].target_period;
+    } else {
+        channel_states[ch].curr_period = channel_states[ch].glide_start_period + (channel_states[ch].target_period - channel_states[ch].glide_start_period) * elapsed.count() / glide_time.count();
+    }
+}
+
 void sequencer_thread_func() {
     while(working) {
         bool updateshiftreg = false;
@@ -239,6 +326,7 @@ void sequencer_thread_func() {
         bool updatechip1 = false;
         gpiomtx.try_lock();
         for(int i = 0; i < CH_NUM; i++) {
+            update_bend(i);
             if((channel_states[i].curr_phase != 0 || channel_states[i].curr_period.count() != 0) && (std::chrono::high_resolution_clock::now() - channel_states[i].last_time >= channel_states[i].curr_period)) {
                 switch(i) {
                     case 0:
@@ -294,6 +382,7 @@ void sequencer_thread_func() {
                             updatechip1 = true;
                             channel_states[i].enabled = false;
                             channel_states[i].curr_period = std::chrono::high_resolution_clock::duration(0);
+                            channel_states[i].target_period = channel_states[i].curr_period;
                             channel_states[i].curr_phase = 0;
                             channel_states[i].remapped = 0;
                             channel_states[i].curr_velocity = 0;
@@ -394,25 +483,15 @@ void alsa_subscribe_to(std::string portname) {
     printf("Warning: requested midi port(%s) was not found!\n", portname.c_str());
 }
 
-void set_channel(int ch, long period_us, int velocity) {
+void set_channel(int ch, long period_us, int velocity, int note, bool remapped) {
     while(channel_states[ch].curr_phase != 0) {}
     gpiomtx.try_lock();
+    pending_notes[ch] = {(int32_t)channel_period(ch, period_us, velocity).count(), (int16_t)note, (int8_t)velocity, remapped}; //applied by sequencer
     switch(ch) {
         case 0:
-            //Drive 0 requires double frequency
-            channel_states[ch].curr_period = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/4));
-            if(!channel_states[ch].enabled) {
-                channel_states[ch].last_time = std::chrono::high_resolution_clock::now();
-                shiftreg_state[ch*2] = 0; //enable drive
-                update_shiftreg();
-                std::this_thread::sleep_for(std::chrono::microseconds(2000));
-                channel_states[ch].enabled = true;
-            }
-            break;
         case 1:
         case 2:
         case 3:
-            channel_states[ch].curr_period = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/2));
             if(!channel_states[ch].enabled) {
                 channel_states[ch].last_time = std::chrono::high_resolution_clock::now();
                 shiftreg_state[ch*2] = 0; //enable drive
@@ -422,17 +501,10 @@ void set_channel(int ch, long period_us, int velocity) {
             }
             break;
         case 4:
-            channel_states[ch].enabled = true;
-            channel_states[ch].curr_period = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/2));
-            break;
         case 5:
-            channel_states[ch].enabled = true;
-            channel_states[ch].curr_period = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(period_us/2));
-            break;
         case 6:
         case 7:
             channel_states[ch].enabled = true;
-            channel_states[ch].curr_period = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::microseconds(velocity*550L));
             break;
     }
     gpiomtx.unlock();
@@ -445,15 +517,15 @@ void clear_channel(int ch) {
         case 1:
         case 2:
         case 3:
-            channel_states[ch].curr_period = std::chrono::high_resolution_clock::duration(0);
+            pending_notes[ch] = {0, 0, 0, false};
             break;
         case 4:
             channel_states[ch].enabled = false;
-            channel_states[ch].curr_period = std::chrono::high_resolution_clock::duration(0);
+            pending_notes[ch] = {0, 0, 0, false};
             break;
         case 5:
             channel_states[ch].enabled = false;
-            channel_states[ch].curr_period = std::chrono::high_resolution_clock::duration(0);
+            pending_notes[ch] = {0, 0, 0, false};
             break;
     }
     gpiomtx.unlock();
@@ -469,7 +541,8 @@ void play_note(int ch, int note, int velocity) {
         if((f >= channel_cfgs[ch].min_frequency && f <= channel_cfgs[ch].max_frequency) && (channel_states[ch].remapped || channel_states[ch].curr_playing_note == 0)) {
             if(verbose)
                 printf("     Channel %d playing note %f\n", ch, f);
-            set_channel(ch, period_us, velocity);
+            pending_bends[ch] = NO_BEND; //drop bend for previous note
+            set_channel(ch, period_us, velocity, note, false);
             channel_states[ch].curr_playing_note = note;
             channel_states[ch].curr_velocity = velocity;
             channel_states[ch].remapped = false;
@@ -481,7 +554,7 @@ void play_note(int ch, int note, int velocity) {
                     if(f >= channel_cfgs[i].min_frequency && f <= channel_cfgs[i].max_frequency) {
                         if(verbose)
                             printf("     Channel %d remapping note %f to %d(currently playing %d)\n", ch, f, i, channel_states[ch].curr_playing_note);
-                        set_channel(i, period_us, velocity);
+                        set_channel(i, period_us, velocity, note, true);
                         channel_states[i].curr_playing_note = note;
                         channel_states[ch].curr_velocity = velocity;
                         channel_states[i].remapped = true;
@@ -494,7 +567,8 @@ void play_note(int ch, int note, int velocity) {
                 if((f >= channel_cfgs[ch].min_frequency && f <= channel_cfgs[ch].max_frequency)) {
                     if(verbose)
                         printf("     Channel %d overwriting note %f\n", ch, f);
-                    set_channel(ch, period_us, velocity);
+                    pending_bends[ch] = NO_BEND; //drop bend for previous note
+                    set_channel(ch, period_us, velocity, note, false);
                     channel_states[ch].curr_playing_note = note;
                     channel_states[ch].curr_velocity = velocity;
                     channel_states[ch].remapped = false;
@@ -526,23 +600,25 @@ void play_note(int ch, int note, int velocity) {
             case 80: //Mute Triangle
             case 81: //Open Triangle
                 //higher drums or cymbals/hats
-                set_channel(6, period_us, velocity);
+                set_channel(6, period_us, velocity, note, false);
                 break;
             default:
                 //drums or other
-                set_channel(7, period_us, velocity);
+                set_channel(7, period_us, velocity, note, false);
                 break;
         }
     } else {
-        set_channel(ch, period_us, velocity);
+        set_channel(ch, period_us, velocity, note, false);
     }
 }
 
 void stop_note(int ch, int note) {
-    if(ch >= 8 && ch != 9) {
+    if(ch >= CH_NUM) {
+        //drum channels stop by themselves
         return;
     }
     if(channel_states[ch].curr_playing_note == note && !channel_states[ch].remapped) {
+        pending_bends[ch] = NO_BEND;
         clear_channel(ch);
         channel_states[ch].curr_playing_note = 0;
         channel_states[ch].curr_velocity = 0;
@@ -562,13 +638,12 @@ void stop_note(int ch, int note) {
 }
 
 void pitch_bend(int ch, int bend) {
+    if(ch >= CH_NUM) {
+        return;
+    }
     if(ch != 6 && ch != 7) {
-        if(channel_states[ch].curr_playing_note != 0 && !channel_states[ch].remapped) {
-            float semitone_bend = bend/4096.0f;
-            double f = midiNoteToFrequency(channel_states[ch].curr_playing_note+semitone_bend);;
-            long period_us = (1000000L / f);
-            set_channel(ch, period_us, channel_states[ch].curr_velocity);
-        }
+        //Coalesced, applied by sequencer
+        pending_bends[ch] = bend;
     }
 }
 